@@ -28,11 +28,20 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <unistd.h>  /* Needed for sbrk and brk */
+#include <fcntl.h> /* To open the trace file */
+#include <sys/syscall.h> /* To tag trace events with the thread id */
+#include <pthread.h> /* pthread_atfork, to restart the trace in children */
+#include <limits.h> /* PATH_MAX for the children's trace files */
 #include <stdint.h> /* Needed for the uint64_t and intptr_t */
 #include <stdbool.h> 
 #include <stdio.h> /* debug by printing */
 #include <assert.h> /* Dragons be flying :P */
 #include <errno.h> /* To set errno in case of failure */
+#include <stdlib.h> /* getenv and atexit for the trace recorder */
+#include <time.h> /* To timestamp trace events */
+
+#include "mm.h"
+#include "mm_trace.h"
 
 #define DEBUG 1 /* set this to 0 if you want to stop the debugging code */
 /* Debug print macro that works only when the debug is define. 
@@ -54,9 +63,25 @@ static int DEBUG_COUNT;
                 __VA_ARGS__);\
     } \
     while(0)
+/* Whether my_malloc/my_free are being recorded; we only know after the
+    first call reads TRACE_ENV_VAR */
+#define TRACE_UNKNOWN 0
+#define TRACE_OFF 1
+#define TRACE_ON 2
+static int TRACE_STATE = TRACE_UNKNOWN;
+/* Records an allocator event when tracing is on, when it's off this costs
+    a single test */
+#define TRACE_EVENT(type, address, size, list_num, grew_heap) \
+    do { \
+    if(TRACE_STATE != TRACE_OFF) \
+        record_event(type, address, size, list_num, grew_heap); \
+    } \
+    while(0)
+/* How many events a thread buffers before writing them to the trace file */
+#define TRACE_BUFFER_EVENTS 2048
 #define FREE_LISTS_COUNT 11 /* How many segregated lists we're maintaining */
-/* Min block size in bytes =  footer + header + nextFree pointer */
-#define MIN_BLOCK_SIZE ((2 * sizeof(struct block_header)) + 8)
+/* Min block size in bytes =  footer + header + nextFree + prevFree pointers */
+#define MIN_BLOCK_SIZE ((2 * sizeof(struct block_header)) + 16)
 /* Clears the alloc bit in the header to indicate that this block is free */
 #define SET_FREE(header) ((header->block_size)=((header->block_size) & (~0x2)))
 /* Sets the alloc bit in the header to indicate this block is allocated */
@@ -64,6 +89,24 @@ static int DEBUG_COUNT;
 /* Sets up the boundary tag - it's a 64-bits of 1 that marks the start & end of
     the heap*/
 #define SET_BOUND_TAG(header) ((header->block_size) = (~(0)))
+/* Tests the alloc bit; boundary tags are all 1s so they read as allocated */
+#define IS_ALLOC(header) (((header->block_size) & 0x2) != 0)
+/* Reads how many bytes are in the block, masking off the status bits */
+#define GET_SIZE(header) ((header->block_size) & ~0x7)
+/* How many bytes a region chunk hands out when the caller doesn't say */
+#define REGION_DEFAULT_CHUNK_SIZE 4096
+/* The biggest chunk a region asks for; grow_heap may sbrk 128 times the
+    size and sbrk takes an intptr_t, so anything larger could wrap */
+#define REGION_MAX_CHUNK_SIZE (INTPTR_MAX / 128)
+/* Blocks up to this size (lists 0 & 1) are freed into the quick lists */
+#define QUICK_MAX_SIZE 64
+/* One exact-size quick list per multiple of 8, from MIN_BLOCK_SIZE up to
+    QUICK_MAX_SIZE */
+#define QUICK_LISTS_COUNT ((int)((QUICK_MAX_SIZE - MIN_BLOCK_SIZE) / 8) + 1)
+/* The quick list blocks of size bytes go in */
+#define QUICK_INDEX(size) (((size) - MIN_BLOCK_SIZE) / 8)
+/* How many blocks a quick list may hold before we consolidate them all */
+#define QUICK_LIST_LIMIT 128
 
 /* struct definitions */
 struct block_header/* Used for lists[5-10] */
@@ -76,7 +119,43 @@ struct block_header/* Used for lists[5-10] */
                 block. */
 };
 
+struct region_chunk/* Overlays the start of a block owned by a region */
+{
+    struct block_header header;
+    struct region_chunk *next_chunk;/* The chunk allocated after this one */
+};
+
+struct my_region/* Lives right after the link of the region's first chunk */
+{
+    struct region_chunk *first_chunk;
+    struct region_chunk *current_chunk;/* The chunk we're bumping in */
+    uint8_t *bump;/* Where the next allocation starts */
+    uint8_t *limit;/* The footer of current_chunk */
+    size_t chunk_size;/* How many bytes each new chunk hands out */
+};
+
+struct trace_buffer/* One per recording thread, allocated with get_block */
+{
+    struct trace_buffer *next_buffer;/* Every buffer is in trace_buffers */
+    uint32_t thread_id;
+    uint32_t event_count;/* How many events wait to be flushed */
+    struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
 /* static function prototypes */
+static uint8_t *get_block(size_t size, int list_num);
+static struct region_chunk *get_region_chunk(size_t size);
+static void release_block(uint8_t *block);
+static uint8_t *coalesce_block(uint8_t *block);
+static void consolidate_quick_lists(void);
+static void record_event(int type, void *address, size_t size,
+                            int list_num, bool grew_heap);
+static void start_trace(void);
+static int open_trace_file(const char *path);
+static void restart_trace_in_child(void);
+static struct trace_buffer *get_trace_buffer(void);
+static void flush_trace_buffer(struct trace_buffer *buffer);
+static void flush_trace_buffers(void);
 static inline int pick_list(size_t size);
 static uint8_t *extract_free_block(int list_num, size_t size);
 static inline uint8_t *search_list(int list_num, size_t size);
@@ -87,9 +166,21 @@ static inline struct block_header *get_footer(uint8_t *block);
 static uint8_t *grow_heap(size_t size);
 static inline int set_initial_boundries(void);
 static inline void add_free_block_to_list(int list_num, uint8_t *new_block);
+static inline void remove_free_block_from_list(int list_num, uint8_t *block);
 
 /* static variables */
 static uint8_t *free_lists[FREE_LISTS_COUNT];
+/* Freed small blocks, indexed by QUICK_INDEX; they stay marked as
+    allocated so nothing coalesces into them until they're consolidated */
+static uint8_t *quick_lists[QUICK_LISTS_COUNT];
+static int quick_lists_length[QUICK_LISTS_COUNT];
+/* How many times the heap was grown; lets the trace tell if a call grew it */
+static uint64_t grow_heap_count;
+static int trace_fd = -1;
+static const char *trace_path;/* Where TRACE_ENV_VAR pointed at startup */
+/* Every thread's buffer, pushed without locking so all can be flushed */
+static struct trace_buffer *trace_buffers;
+static __thread struct trace_buffer *thread_trace_buffer;
 
 /// <summary> 
 /// Does what you'd expect the malloc C standard library to do, check 
@@ -103,88 +194,535 @@ static uint8_t *free_lists[FREE_LISTS_COUNT];
 void *my_malloc(size_t size)
 {
     uint8_t *user_data; /* The pointer we will return to the user */
+    size_t block_size; /* The header+footer+size, aligned to 8 */
+    uint64_t grow_count = grow_heap_count;
+    int list_num;
+    if(size <= 0)
+        return NULL;
+    block_size = MM_BLOCK_SIZE(size);
+    list_num = pick_list(block_size);
+    DEBUG_PRINT("size requested: %zd\n", block_size);
+    user_data = get_block(block_size, list_num);
+    if(user_data != NULL)
+        user_data = user_data + 8;/* Now points past the header */
+    TRACE_EVENT(TRACE_MALLOC, user_data, size, list_num,
+                    grow_count != grow_heap_count);
+    DEBUG_PRINT("%s\n", "-------------------------------------");
+    if(user_data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return user_data;
+}
+
+/// <summary>
+/// my_malloc for callers that already know the block size and its list;
+/// mm.h calls this when the requested size is a compile-time constant
+/// </summary>
+/// <param name='size'> How many bytes the user asked for </param>
+/// <param name='block_size'>
+/// The size of the block in bytes, as computed by MM_BLOCK_SIZE
+/// </param>
+/// <param name='list_num'>
+/// The list block_size belongs to, as computed by MM_PICK_LIST
+/// </param>
+/// <return>
+/// A properely aligned pointer to a block of memory of at least
+/// block_size minus the header and footer bytes, or NULL on failure
+/// </return>
+void *my_malloc_class(size_t size, size_t block_size, int list_num)
+{
+    uint8_t *user_data; /* The pointer we will return to the user */
+    uint64_t grow_count = grow_heap_count;
+    user_data = get_block(block_size, list_num);
+    if(user_data != NULL)
+        user_data = user_data + 8;/* Now points past the header */
+    TRACE_EVENT(TRACE_MALLOC, user_data, size, list_num,
+                    grow_count != grow_heap_count);
+    if(user_data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return user_data;
+}
+
+/// <summary>
+/// Creates a region whose allocations are bump-pointer carved out of
+/// chunks taken from the free lists; the region descriptor itself lives
+/// at the start of the first chunk.
+/// </summary>
+/// <param name='chunk_size'>
+/// How many bytes each chunk should be able to hand out, 0 picks
+/// REGION_DEFAULT_CHUNK_SIZE
+/// </param>
+/// <return> A pointer to the new region or NULL on failure </return>
+struct my_region *my_region_create(size_t chunk_size)
+{
+    struct region_chunk *chunk;
+    struct my_region *region;
+    if(chunk_size == 0)
+        chunk_size = REGION_DEFAULT_CHUNK_SIZE;
+    /* Checked before rounding up so neither the rounding nor the
+        additions in get_region_chunk can wrap */
+    if(chunk_size > REGION_MAX_CHUNK_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    chunk_size = (chunk_size+7) & ~7;/* Align the size to 8-byte boundary */
+    chunk = get_region_chunk(chunk_size + sizeof(struct my_region));
+    if(chunk == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    region = (struct my_region *)(chunk + 1);
+    region->first_chunk = chunk;
+    region->current_chunk = chunk;
+    region->bump = (uint8_t *)(region + 1);
+    region->limit = (uint8_t *)get_footer((uint8_t *)chunk);
+    region->chunk_size = chunk_size;
+    DEBUG_PRINT("region created with chunks of %zd bytes\n", chunk_size);
+    return region;
+}
+
+/// <summary>
+/// Allocates from the region by bumping a pointer; the returned block has
+/// no header or footer and can only be released by resetting or
+/// destroying the region.
+/// </summary>
+/// <param name='region'> The region to allocate from </param>
+/// <param name='size'> How many bytes the user needs to allocate </param>
+/// <return>
+/// An 8-byte aligned pointer to at least size bytes or NULL on failure
+/// </return>
+void *my_region_alloc(struct my_region *region, size_t size)
+{
+    struct region_chunk *chunk;
+    uint8_t *user_data;
+    if(size <= 0)
+        return NULL;
+    /* Checked before rounding up so the rounding can't wrap to 0 */
+    if(size > REGION_MAX_CHUNK_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size+7) & ~7;/* Align the size to 8-byte boundary */
+    /* The current chunk is exhausted, link a fresh one after it */
+    if(size > (size_t)(region->limit - region->bump)) {
+        chunk = get_region_chunk(size > region->chunk_size ?
+                                    size : region->chunk_size);
+        if(chunk == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        region->current_chunk->next_chunk = chunk;
+        region->current_chunk = chunk;
+        region->bump = (uint8_t *)(chunk + 1);
+        region->limit = (uint8_t *)get_footer((uint8_t *)chunk);
+    }
+    user_data = region->bump;
+    region->bump += size;
+    return user_data;
+}
+
+/// <summary>
+/// Frees everything allocated from the region in one go; every chunk but
+/// the first is handed back to the free lists and the first one is rewound.
+/// </summary>
+/// <param name='region'> The region to reset </param>
+/// <return> Nothing </return>
+void my_region_reset(struct my_region *region)
+{
+    struct region_chunk *chunk, *next_chunk;
+    chunk = region->first_chunk->next_chunk;
+    while(chunk != NULL) {
+        next_chunk = chunk->next_chunk;
+        release_block((uint8_t *)chunk);
+        chunk = next_chunk;
+    }
+    region->first_chunk->next_chunk = NULL;
+    region->current_chunk = region->first_chunk;
+    region->bump = (uint8_t *)(region + 1);
+    region->limit = (uint8_t *)get_footer((uint8_t *)region->first_chunk);
+}
+
+/// <summary>
+/// Hands every chunk of the region, including the one holding the
+/// region itself, back to the free lists
+/// </summary>
+/// <param name='region'> The region to destroy </param>
+/// <return> Nothing </return>
+void my_region_destroy(struct my_region *region)
+{
+    struct region_chunk *first_chunk = region->first_chunk;
+    my_region_reset(region);
+    release_block((uint8_t *)first_chunk);
+}
+
+/// <summary>
+/// Does what you'd expect the free C standard library to do; small blocks
+/// are pushed on their quick list and only coalesced later, everything
+/// else is coalesced and put back in the free lists right away.
+/// </summary>
+/// <param name='ptr'>
+/// A pointer returned by my_malloc that wasn't freed yet, or NULL
+/// </param>
+/// <return> Nothing </return>
+void my_free(void *ptr)
+{
+    uint8_t *block;
+    uint64_t *nextFree;
+    uint64_t size;
+    int quick_num;
+    if(ptr == NULL)
+        return;
+    block = (uint8_t *)ptr - 8;/* Now points to the header */
+    size = GET_SIZE(((struct block_header *)block));
+    DEBUG_PRINT("freeing block of size %lu\n", size);
+    TRACE_EVENT(TRACE_FREE, ptr, size, pick_list(size), false);
+    if(size > QUICK_MAX_SIZE) {
+        release_block(block);
+        return;
+    }
+    /* List manipulation is always done in words, not bytes
+        to avoid several complexities */
+    quick_num = QUICK_INDEX(size);
+    nextFree = (uint64_t *)(block + 8);
+    *nextFree = (intptr_t) quick_lists[quick_num];
+    quick_lists[quick_num] = block;
+    if(++quick_lists_length[quick_num] > QUICK_LIST_LIMIT)
+        consolidate_quick_lists();
+}
+
+/// <summary>
+/// Takes a block out of the free lists (growing the heap if needed),
+/// slices off what's left over and marks the block as allocated
+/// </summary>
+/// <param name='size'>
+/// The size of the block we need in bytes; already includes the header,
+/// footer and is aligned to 8
+/// </param>
+/// <param name='list_num'> The list size belongs to </param>
+/// <return> A pointer to the header of the block or NULL on failure </return>
+static uint8_t *get_block(size_t size, int list_num)
+{
+    uint8_t *block; /* The block we will return */
     uint8_t *new_block; /* Used to point to the block added by grow_heap */
     uint8_t *sliced_block; /* Used to point to the left-over of a block */
     struct block_header *header, *footer, *slice_header;
     int slice_list;/* Which list the slice belongs to */
-    if(size <= 0)
-        return NULL;
-    size += sizeof(struct block_header) * 2; /* The header+footer */
-    size = (size+7) & ~7;/* Align the size to 8-byte boundary */
-    /* Identify which list to pick from */
-    int list_num = pick_list(size);
-    DEBUG_PRINT("size requested: %zd\n", size);
+    int quick_num;
+    /* A freed block of this exact size is still marked allocated, reuse it */
+    if(size <= QUICK_MAX_SIZE && quick_lists[QUICK_INDEX(size)] != NULL) {
+        quick_num = QUICK_INDEX(size);
+        block = quick_lists[quick_num];
+        quick_lists[quick_num] = (uint8_t *)(intptr_t)(*(uint64_t *)(block+8));
+        quick_lists_length[quick_num]--;
+        DEBUG_PRINT("Reused block from quick_list[%d]\n", quick_num);
+        return block;
+    }
     DEBUG_PRINT("List picked: %d\n", list_num);
-    user_data = extract_free_block(list_num, size);
+    block = extract_free_block(list_num, size);
+    /* Merging the quick lists back may make a big-enough block */
+    if(block == NULL) {
+        consolidate_quick_lists();
+        block = extract_free_block(list_num, size);
+    }
     /* If no list had enough space */
-    if(user_data == NULL) {
-        if((new_block = grow_heap(size)) == NULL) {
-            DEBUG_PRINT("%s\n", "-------------------------------------");
-            errno = ENOMEM;
+    if(block == NULL) {
+        if((new_block = grow_heap(size)) == NULL)
             return NULL;
-        }
         add_free_block_to_list(list_num, new_block);
-        user_data = extract_free_block(list_num, size);
+        block = extract_free_block(list_num, size);
     }
-    assert(user_data != NULL);
+    assert(block != NULL);
     DEBUG_PRINT("%s\n", "Found a block!");
     /* If we can slice, add the left-over back to our lists */
-    sliced_block = slice_block(user_data, size);
+    sliced_block = slice_block(block, size);
     if(sliced_block != NULL) {
         slice_header = (struct block_header *) sliced_block;
         slice_list = pick_list(slice_header->block_size);
         add_free_block_to_list(slice_list, sliced_block);
     }
     /* Mark the block as allocated */
-    header = (struct block_header *) user_data;
+    header = (struct block_header *) block;
     SET_ALLOC(header);
-    footer = get_footer(user_data);
+    footer = get_footer(block);
     SET_ALLOC(footer);
-    user_data = user_data + 8;/* Now points past the header */
-    DEBUG_PRINT("%s\n", "-------------------------------------");
-    return user_data;
+    return block;
 }
 
-/// <summary> Chooses which list this size belongs to </summary>
-/// <param name='size'> The size of block </param>
-/// <return> The index of the list the block of size belongs to </return>
-static inline int pick_list(size_t size)
+/// <summary>
+/// Gets a block big enough to hold the chunk link and size bytes of
+/// region data
+/// </summary>
+/// <param name='size'> How many bytes of data the chunk must hold </param>
+/// <return> A pointer to the new chunk or NULL on failure </return>
+static struct region_chunk *get_region_chunk(size_t size)
 {
-    if(size <= 32) {
-        return 0;
-    }
-    else if(size <= 64) { 
-        return 1;
-    }
-    else if(size <= 128) {
-        return 2;
+    struct region_chunk *chunk;
+    if(size > REGION_MAX_CHUNK_SIZE - sizeof(struct region_chunk)
+                - sizeof(struct block_header))
+        return NULL;
+    /* The chunk link + the data + the footer */
+    size += sizeof(struct region_chunk) + sizeof(struct block_header);
+    chunk = (struct region_chunk *)get_block(size, pick_list(size));
+    if(chunk == NULL)
+        return NULL;
+    chunk->next_chunk = NULL;
+    return chunk;
+}
+
+/// <summary>
+/// Marks an allocated block as free, coalesces it with its neighbours and
+/// puts the result back in its list
+/// </summary>
+/// <param name='block'> A pointer to the header of the block </param>
+/// <return> Nothing </return>
+static void release_block(uint8_t *block)
+{
+    struct block_header *header, *footer;
+    header = (struct block_header *) block;
+    footer = get_footer(block);
+    SET_FREE(header);
+    SET_FREE(footer);
+    block = coalesce_block(block);
+    header = (struct block_header *) block;
+    add_free_block_to_list(pick_list(header->block_size), block);
+}
+
+/// <summary>
+/// Merges a free block, that's in no list, with the free blocks right
+/// before and right after it; the neighbours are taken out of their lists
+/// </summary>
+/// <param name='block'> A pointer to the header of the free block </param>
+/// <return> A pointer to the header of the merged block </return>
+static uint8_t *coalesce_block(uint8_t *block)
+{
+    struct block_header *header, *prev_ftr, *next_hdr;
+    header = (struct block_header *) block;
+    next_hdr = (struct block_header *)(block + header->block_size);
+    if(!IS_ALLOC(next_hdr)) {
+        DEBUG_PRINT("merging with next block of size %lu\n",
+                        next_hdr->block_size);
+        remove_free_block_from_list(pick_list(next_hdr->block_size),
+                                        (uint8_t *)next_hdr);
+        header->block_size += next_hdr->block_size;
+        get_footer(block)->block_size = header->block_size;
     }
-    else if(size <= 256) {
-        return 3;
+    prev_ftr = header - 1;
+    if(!IS_ALLOC(prev_ftr)) {
+        DEBUG_PRINT("merging with previous block of size %lu\n",
+                        prev_ftr->block_size);
+        block -= prev_ftr->block_size;
+        remove_free_block_from_list(pick_list(prev_ftr->block_size), block);
+        ((struct block_header *)block)->block_size += header->block_size;
+        header = (struct block_header *) block;
+        get_footer(block)->block_size = header->block_size;
     }
-    else if(size <= 512) {
-        return 4;
+    return block;
+}
+
+/// <summary>
+/// Empties every quick list, coalescing each of their blocks back into the
+/// free lists
+/// </summary>
+/// <return> Nothing </return>
+static void consolidate_quick_lists(void)
+{
+    uint8_t *block;
+    for(int i = 0; i < QUICK_LISTS_COUNT; i++) {
+        while((block = quick_lists[i]) != NULL) {
+            quick_lists[i] = (uint8_t *)(intptr_t)(*(uint64_t *)(block + 8));
+            release_block(block);
+        }
+        quick_lists_length[i] = 0;
     }
-    else if(size <= 1024) {
-        return 5;
+}
+
+/// <summary>
+/// Appends an event to the calling thread's trace buffer, flushing the
+/// buffer to the trace file once it's full; errno is left untouched
+/// </summary>
+/// <param name='type'> TRACE_MALLOC or TRACE_FREE </param>
+/// <param name='address'> The pointer returned or being freed </param>
+/// <param name='size'> The size to record with the event </param>
+/// <param name='list_num'> The list pick_list chose </param>
+/// <param name='grew_heap'> Whether the call had to grow the heap </param>
+/// <return> Nothing </return>
+static void record_event(int type, void *address, size_t size,
+                            int list_num, bool grew_heap)
+{
+    struct trace_buffer *buffer;
+    struct trace_event *event;
+    struct timespec now;
+    int saved_errno = errno;
+    if(TRACE_STATE == TRACE_UNKNOWN)
+        start_trace();
+    if(TRACE_STATE != TRACE_ON || (buffer = get_trace_buffer()) == NULL) {
+        errno = saved_errno;
+        return;
     }
-    else if(size <= 2048) {
-        return 6;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event = &buffer->events[buffer->event_count++];
+    event->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->address = (intptr_t)address;
+    event->size = size;
+    event->thread_id = buffer->thread_id;
+    event->type = type;
+    event->list_num = list_num;
+    event->grew_heap = grew_heap;
+    event->reserved = 0;
+    if(buffer->event_count == TRACE_BUFFER_EVENTS)
+        flush_trace_buffer(buffer);
+    errno = saved_errno;
+}
+
+/// <summary>
+/// Turns tracing on if TRACE_ENV_VAR names a file we can write the trace
+/// header to, off otherwise
+/// </summary>
+/// <return> Nothing </return>
+static void start_trace(void)
+{
+    const char *path = getenv(TRACE_ENV_VAR);
+    TRACE_STATE = TRACE_OFF;
+    if(path == NULL || *path == '\0')
+        return;
+    if((trace_fd = open_trace_file(path)) < 0)
+        return;
+    trace_path = path;
+    atexit(flush_trace_buffers);
+    pthread_atfork(NULL, NULL, restart_trace_in_child);
+    TRACE_STATE = TRACE_ON;
+}
+
+/// <summary>
+/// Creates (or truncates) a trace file and writes its header
+/// </summary>
+/// <param name='path'> Where the trace file goes </param>
+/// <return> The file descriptor of the trace file or -1 on failure </return>
+static int open_trace_file(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd < 0) {
+        DEBUG_PRINT("Failed to open trace file %s\n", path);
+        return -1;
     }
-    else if(size <= 4096) {
-        return 7;
+    if(write(fd, TRACE_MAGIC, 8) != 8) {
+        DEBUG_PRINT("Failed to write trace header to %s\n", path);
+        close(fd);
+        return -1;
     }
-    else if(size <= 8192) {
-        return 8;
+    return fd;
+}
+
+/// <summary>
+/// Runs in the child after a fork: drops the events inherited from the
+/// parent (the parent flushes those itself) and records the child in its
+/// own file, the parent's path followed by .pid
+/// </summary>
+/// <return> Nothing </return>
+static void restart_trace_in_child(void)
+{
+    struct trace_buffer *buffer, *next_buffer;
+    char path[PATH_MAX];
+    if(TRACE_STATE != TRACE_ON)
+        return;
+    /* Only the forking thread lives on in the child; the other threads'
+        buffers go back to the free lists */
+    for(buffer = trace_buffers; buffer != NULL; buffer = next_buffer) {
+        next_buffer = buffer->next_buffer;
+        if(buffer != thread_trace_buffer)
+            release_block((uint8_t *)buffer - 8);
     }
-    else if(size <= 16384) {
-        return 9;
+    trace_buffers = thread_trace_buffer;
+    if(thread_trace_buffer != NULL) {
+        thread_trace_buffer->next_buffer = NULL;
+        thread_trace_buffer->event_count = 0;
+        thread_trace_buffer->thread_id = syscall(SYS_gettid);
     }
-    else {
-        return 10;
+    close(trace_fd);
+    TRACE_STATE = TRACE_OFF;
+    snprintf(path, sizeof(path), "%s.%d", trace_path, (int)getpid());
+    if((trace_fd = open_trace_file(path)) >= 0)
+        TRACE_STATE = TRACE_ON;
+}
+
+/// <summary>
+/// Returns the calling thread's trace buffer, taking it out of the heap
+/// the first time the thread records an event
+/// </summary>
+/// <return> The thread's buffer or NULL if it couldn't be allocated </return>
+static struct trace_buffer *get_trace_buffer(void)
+{
+    struct trace_buffer *buffer = thread_trace_buffer;
+    size_t block_size;
+    uint8_t *block;
+    if(buffer != NULL)
+        return buffer;
+    block_size = MM_BLOCK_SIZE(sizeof(struct trace_buffer));
+    if((block = get_block(block_size, pick_list(block_size))) == NULL)
+        return NULL;
+    buffer = (struct trace_buffer *)(block + 8);/* Past the header */
+    buffer->thread_id = syscall(SYS_gettid);
+    buffer->event_count = 0;
+    /* Push on trace_buffers; other threads may be pushing too */
+    buffer->next_buffer = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&trace_buffers, &buffer->next_buffer,
+                buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    thread_trace_buffer = buffer;
+    return buffer;
+}
+
+/// <summary>
+/// Writes the events waiting in a buffer to the trace file and empties it;
+/// the events are written with one call so threads don't interleave them,
+/// short writes are finished off so no record is ever cut in half
+/// </summary>
+/// <param name='buffer'> The buffer to flush </param>
+/// <return> Nothing </return>
+static void flush_trace_buffer(struct trace_buffer *buffer)
+{
+    uint8_t *data = (uint8_t *)buffer->events;
+    size_t length = buffer->event_count * sizeof(struct trace_event);
+    ssize_t written;
+    buffer->event_count = 0;
+    while(length > 0 && TRACE_STATE == TRACE_ON) {
+        written = write(trace_fd, data, length);
+        if(written < 0 && errno == EINTR)
+            continue;
+        /* WARNING: A FAILED WRITE LEAVES A PARTIAL RECORD BEHIND, STOP
+            TRACING SO NOTHING MISALIGNED IS APPENDED AFTER IT */
+        if(written <= 0) {
+            DEBUG_PRINT("Failed to write %zd bytes of trace, "
+                        "tracing stopped\n", length);
+            TRACE_STATE = TRACE_OFF;
+            return;
+        }
+        data += written;
+        length -= written;
     }
 }
 
+/// <summary> Flushes every thread's buffer, runs at exit </summary>
+/// <return> Nothing </return>
+static void flush_trace_buffers(void)
+{
+    struct trace_buffer *buffer;
+    buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for(; buffer != NULL; buffer = buffer->next_buffer)
+        flush_trace_buffer(buffer);
+}
+
+/// <summary> Chooses which list this size belongs to </summary>
+/// <param name='size'> The size of block </param>
+/// <return> The index of the list the block of size belongs to </return>
+static inline int pick_list(size_t size)
+{
+    return MM_PICK_LIST(size);
+}
+
 /// <summary> 
 /// Searches each list(starting from list_num) for a big-enough free block 
 /// </summary>
@@ -206,6 +744,7 @@ static uint8_t *extract_free_block(int list_num, size_t size)
                                                                 , size);
         if((data = search_list(i, size)) != NULL) {
             DEBUG_PRINT("Found block in list[%d]\n", i);
+            remove_free_block_from_list(i, data);
             return data;
         }
     }
@@ -359,7 +898,7 @@ static uint8_t *slice_block(uint8_t *block, size_t requested_size)
     DEBUG_PRINT("slice size: %lu\n", slice_header->block_size);
     /* Change the original block size and footer */
     original_ftr = slice_header - 1;
-    original_ftr->block_size = original_hdr->block_size - requested_size;
+    original_ftr->block_size = requested_size;
     original_hdr->block_size = original_ftr->block_size;
     return slice;
 }
@@ -373,7 +912,7 @@ static inline struct block_header *get_footer(uint8_t *block)
 {
     struct block_header *header, *footer;
     header = (struct block_header *) block;
-    block = block + header->block_size - 8;
+    block = block + GET_SIZE(header) - 8;
     footer = (struct block_header *)block;
     return footer;
 }
@@ -467,6 +1006,7 @@ static uint8_t *grow_heap(size_t size)
         }
     }
     assert(sbrk_worked == true);
+    grow_heap_count++;
     if((new_brk = sbrk(0)) == (void*)-1) {
         DEBUG_PRINT("%s\n", "Failed to query sbrk! Returning NULL");
         return NULL;
@@ -482,9 +1022,9 @@ static uint8_t *grow_heap(size_t size)
     header->block_size = block_size;
     /* set up the footer */
     footer = (struct block_header*) new_brk;/* errCheck = current brk */  
-    footer -= 8;/* Now footer points to the brk boundary tag */
+    footer -= 1;/* Now footer points to the brk boundary tag */
     SET_BOUND_TAG(footer);/* Set a new boundary tag  */
-    footer -= 8;/* Points to the footer of the newely allocated block */    
+    footer -= 1;/* Points to the footer of the newely allocated block */    
     footer->block_size = block_size;
     return old_brk;
 }
@@ -528,9 +1068,44 @@ static inline void add_free_block_to_list(int list_num, uint8_t *new_block)
     /* List manipulation is always done in words, not bytes
         to avoid several complexities */
     uint64_t *nextFree = (uint64_t *)(new_block + 8);
+    uint64_t *prevFree = nextFree + 1;
     DEBUG_PRINT("a new block of size %lu was added to list[%d]\n", 
                 ((struct block_header*)new_block)->block_size,
                                 list_num);
     *nextFree = (intptr_t) free_lists[list_num];
+    *prevFree = 0;
+    /* The old head's prevFree now points back to us */
+    if(free_lists[list_num] != NULL)
+        *((uint64_t *)(free_lists[list_num] + 16)) = (intptr_t) new_block;
     free_lists[list_num] = new_block;      
 }
+/* end add_free_block_to_list */
+
+/* begin remove_free_block_from_list */
+/// <summary>
+/// unlinks a block from the list it's currently in, in O(1) through its
+/// prevFree and nextFree pointers
+/// </summary>
+/// <param name='list_num'> The list index the block is in </param>
+/// <param name='block'> The block to be removed </param>
+static inline void remove_free_block_from_list(int list_num, uint8_t *block)
+{
+    /* List manipulation is always done in words, not bytes
+        to avoid several complexities */
+    uint64_t *nextFree = (uint64_t *)(block + 8);
+    uint64_t *prevFree = nextFree + 1;
+    uint8_t *next_block = (uint8_t *)(intptr_t)(*nextFree);
+    uint8_t *prev_block = (uint8_t *)(intptr_t)(*prevFree);
+    if(prev_block == NULL) {
+        assert(free_lists[list_num] == block);
+        free_lists[list_num] = next_block;
+    }
+    else {
+        *((uint64_t *)(prev_block + 8)) = *nextFree;
+    }
+    if(next_block != NULL)
+        *((uint64_t *)(next_block + 16)) = *prevFree;
+    DEBUG_PRINT("a block of size %lu was removed from list[%d]\n",
+                ((struct block_header*)block)->block_size, list_num);
+}
+/* end remove_free_block_from_list */
@@ -30,14 +30,53 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef MALLOC_V1_MM_H
 #define MALLOC_V1_MM_H
 
+#include <stddef.h>
+
 /* Macros to replace the standard malloc with this one */
-#define malloc(size) my_malloc(size)
+#define malloc(size) my_malloc_fast(size)
 #define free(pointer) my_free(pointer)
 
 /* These functions are intended to be 100% semantically equivalant to the 
 	standard malloc and free; to read their semantics you may check the
 	 Open-group man pages */
 void *my_malloc(size_t size);
+
+/* The size of the block backing a request of size bytes: payload + header
+    + footer, aligned to 8 bytes and never less than the 32 bytes a free
+    block needs for its header, footer and list pointers */
+#define MM_BLOCK_SIZE(size) \
+    ((size) <= 16 ? (size_t)32 : (((size) + 16 + 7) & ~(size_t)7))
+/* The free list a block of block_size bytes belongs to: list 0 holds blocks
+    of 32 bytes and less and each list after it doubles that, up to list 10.
+    Folds to a constant when block_size is one, a clz otherwise */
+#define MM_PICK_LIST(block_size) \
+    ((block_size) <= 32 ? 0 : \
+    (block_size) > 16384 ? 10 : \
+    59 - __builtin_clzll((unsigned long long)(block_size) - 1))
+
+/* Same as my_malloc but skips computing the block size and its list; size
+    is only passed along so the trace records what was asked for */
+void *my_malloc_class(size_t size, size_t block_size, int list_num);
+
+/* When size is a compile-time constant (e.g. sizeof(T)) the block size and
+    the list are folded here and my_malloc_class is called directly */
+static inline void *my_malloc_fast(size_t size)
+{
+    if(__builtin_constant_p(size) && size > 0)
+        return my_malloc_class(size, MM_BLOCK_SIZE(size),
+                                MM_PICK_LIST(MM_BLOCK_SIZE(size)));
+    return my_malloc(size);
+}
+
+/* Regions hand out header-less blocks by bumping a pointer; they can't be
+    freed one by one, resetting or destroying the region gives all of its
+    chunks back to the allocator at once */
+struct my_region;
+struct my_region *my_region_create(size_t chunk_size);
+void *my_region_alloc(struct my_region *region, size_t size);
+void my_region_reset(struct my_region *region);
+void my_region_destroy(struct my_region *region);
+
 void my_free(void *ptr);
 
 #endif
@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2013, Mhd Adel G. Al Qodamni
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met:
+
+
+Redistributions of source code must retain the above copyright notice, 
+this list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, 
+this list of conditions and the following disclaimer in the documentation 
+and/or other materials provided with the distribution.
+
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MALLOC_V1_MM_TRACE_H
+#define MALLOC_V1_MM_TRACE_H
+
+#include <stdint.h>
+
+/* Setting this environment variable to a path makes the allocator record
+    every my_malloc/my_free to that file */
+#define TRACE_ENV_VAR "MM_TRACE"
+/* The file starts with these 8 bytes, the events follow it back to back */
+#define TRACE_MAGIC "MMTRACE1"
+
+#define TRACE_MALLOC 0
+#define TRACE_FREE 1
+
+/* One recorded call, written in the byte order of the traced machine.
+    Events of different threads are flushed in batches so the file is only
+    ordered per thread; sort on the timestamp to get the global order */
+struct trace_event
+{
+    uint64_t timestamp;/* CLOCK_MONOTONIC in nanoseconds */
+    uint64_t address;/* What my_malloc returned or what my_free got */
+    uint64_t size;/* Bytes requested by my_malloc, block size for my_free */
+    uint32_t thread_id;
+    uint8_t type;/* TRACE_MALLOC or TRACE_FREE */
+    int8_t list_num;/* The list pick_list chose for the block */
+    uint8_t grew_heap;/* 1 if my_malloc had to call grow_heap */
+    uint8_t reserved;
+};
+
+/* mm_trace_convert reads the file in records of exactly 32 bytes, fail the
+    build if padding ever changes that */
+typedef char trace_event_is_32_bytes[sizeof(struct trace_event) == 32 ? 1 : -1];
+
+#endif
@@ -0,0 +1,221 @@
+/* 
+Copyright (c) 2013, Mhd Adel G. Al Qodamni
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met:
+
+
+Redistributions of source code must retain the above copyright notice, 
+this list of conditions and the following disclaimer.
+
+Redistributions in binary form must reproduce the above copyright notice, 
+this list of conditions and the following disclaimer in the documentation 
+and/or other materials provided with the distribution.
+
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Converts a trace recorded with MM_TRACE into the text format of the
+    CS:APP malloc lab driver so it can be replayed against any allocator:
+        <suggested heap size>
+        <number of ids>
+        <number of operations>
+        <weight>
+        a <id> <bytes>
+        f <id>
+    Usage: mm_trace_convert <recorded trace> > <replayable trace> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm_trace.h"
+
+/* struct definitions */
+struct sorted_event/* Remembers where the event was in the file */
+{
+    struct trace_event event;
+    size_t position;
+};
+
+struct live_entry/* Maps the address of an allocation to its id */
+{
+    uint64_t address;
+    uint64_t size;
+    long id;/* -1 once the allocation was freed */
+};
+
+/* static function prototypes */
+static struct sorted_event *read_events(FILE *trace, size_t *count);
+static int compare_events(const void *left, const void *right);
+static struct live_entry *find_entry(struct live_entry *table, size_t mask,
+                                        uint64_t address);
+
+int main(int argc, char *argv[])
+{
+    struct sorted_event *events;
+    struct live_entry *table, *entry;
+    struct trace_event *event;
+    size_t count, table_size, op_count = 0;
+    long id_count = 0;
+    uint64_t live_bytes = 0, peak_bytes = 0;
+    char *ops;/* 'a' or 'f' per event, 0 for events that are dropped */
+    FILE *trace;
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <recorded trace>\n", argv[0]);
+        return 1;
+    }
+    if((trace = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    events = read_events(trace, &count);
+    fclose(trace);
+    if(events == NULL) {
+        fprintf(stderr, "%s is not a readable trace\n", argv[1]);
+        return 1;
+    }
+    /* Threads flush in batches, put the events back in the order they
+        happened */
+    qsort(events, count, sizeof(*events), compare_events);
+    for(table_size = 16; table_size < 2 * count; table_size *= 2)
+        ;
+    table = calloc(table_size, sizeof(*table));
+    ops = calloc(count + 1, sizeof(*ops));
+    if(table == NULL || ops == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        event = &events[i].event;
+        /* Failed mallocs and frees of NULL have nothing to replay */
+        if(event->address == 0)
+            continue;
+        entry = find_entry(table, table_size - 1, event->address);
+        if(event->type == TRACE_MALLOC) {
+            entry->address = event->address;
+            entry->size = event->size;
+            entry->id = id_count++;
+            live_bytes += event->size;
+            if(live_bytes > peak_bytes)
+                peak_bytes = live_bytes;
+            ops[i] = 'a';
+        }
+        else {
+            /* Blocks allocated before the trace started are skipped */
+            if(entry->address != event->address || entry->id < 0)
+                continue;
+            live_bytes -= entry->size;
+            entry->id = -1;
+            ops[i] = 'f';
+        }
+        op_count++;
+    }
+    /* Second pass to print, now that the header values are known */
+    printf("%lu\n%ld\n%zu\n1\n", (unsigned long)peak_bytes, id_count,
+            op_count);
+    memset(table, 0, table_size * sizeof(*table));
+    id_count = 0;
+    for(size_t i = 0; i < count; i++) {
+        event = &events[i].event;
+        if(ops[i] == 0)
+            continue;
+        entry = find_entry(table, table_size - 1, event->address);
+        if(ops[i] == 'a') {
+            entry->address = event->address;
+            entry->id = id_count++;
+            printf("a %ld %lu\n", entry->id, (unsigned long)event->size);
+        }
+        else {
+            printf("f %ld\n", entry->id);
+            entry->id = -1;
+        }
+    }
+    free(ops);
+    free(table);
+    free(events);
+    return 0;
+}
+
+/// <summary>
+/// Reads every event of a recorded trace, checking its magic first
+/// </summary>
+/// <param name='trace'> The recorded trace, opened for reading </param>
+/// <param name='count'> Set to how many events were read </param>
+/// <return> The events in file order or NULL on failure </return>
+static struct sorted_event *read_events(FILE *trace, size_t *count)
+{
+    struct sorted_event *events = NULL, *grown;
+    struct trace_event event;
+    size_t capacity = 0;
+    char magic[8];
+    if(fread(magic, 1, 8, trace) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+        return NULL;
+    *count = 0;
+    while(fread(&event, sizeof(event), 1, trace) == 1) {
+        if(*count == capacity) {
+            capacity = capacity == 0 ? 4096 : capacity * 2;
+            grown = realloc(events, capacity * sizeof(*events));
+            if(grown == NULL) {
+                free(events);
+                return NULL;
+            }
+            events = grown;
+        }
+        events[*count].event = event;
+        events[*count].position = *count;
+        (*count)++;
+    }
+    /* An empty trace is still a valid one */
+    if(events == NULL)
+        events = malloc(sizeof(*events));
+    return events;
+}
+
+/// <summary>
+/// qsort comparator ordering events by timestamp, then by where they
+/// were in the file
+/// </summary>
+/// <param name='left'> The first sorted_event </param>
+/// <param name='right'> The second sorted_event </param>
+/// <return> Negative, zero or positive like strcmp </return>
+static int compare_events(const void *left, const void *right)
+{
+    const struct sorted_event *l = left, *r = right;
+    if(l->event.timestamp != r->event.timestamp)
+        return l->event.timestamp < r->event.timestamp ? -1 : 1;
+    if(l->position != r->position)
+        return l->position < r->position ? -1 : 1;
+    return 0;
+}
+
+/// <summary>
+/// Finds the entry of an address in an open-addressing table, or the
+/// empty slot where it should go
+/// </summary>
+/// <param name='table'> The table, its size is a power of 2 </param>
+/// <param name='mask'> The table size - 1 </param>
+/// <param name='address'> The address to look up </param>
+/// <return> A pointer to the entry or to an empty slot </return>
+static struct live_entry *find_entry(struct live_entry *table, size_t mask,
+                                        uint64_t address)
+{
+    /* Blocks are 8-byte aligned, the low bits don't tell them apart */
+    size_t slot = (size_t)((address >> 3) * 0x9E3779B97F4A7C15ULL) & mask;
+    while(table[slot].address != 0 && table[slot].address != address)
+        slot = (slot + 1) & mask;
+    return &table[slot];
+}
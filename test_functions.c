@@ -27,10 +27,35 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "mm.h"
+#include "mm_trace.h"
+
+/* How many events debug_trace_child records */
+#define TRACE_CHILD_EVENTS 8
+
+static int write_trace(const char *path, struct trace_event *events,
+                        int count);
+static int run_process(const char *const argv[], const char *const envp[],
+                        const char *output);
+static int read_file(const char *path, char *data, int size);
+static int read_trace_event(const char *path, int index,
+							struct trace_event *event);
+static int check_replay(const char *replay, int ids, int ops);
+static int pick_list_by_chain(size_t size);
+
+/* How many times the test code called my_malloc_class */
+static int class_calls;
 
 /* beging debug_alignment */
 void debug_alignment(void)
@@ -46,3 +71,342 @@ void debug_alignment(void)
 	printf("stopped after %d tries\n", i);
 }
 /* end debug_alignment */
+
+/* begin debug_region */
+void debug_region(void)
+{
+	struct my_region *region = my_region_create(256);
+	char *first, *ptr;
+	int i;
+	if(region == NULL) {
+		fprintf(stderr, "my_region_create returned NULL\n");
+		return;
+	}
+	first = my_region_alloc(region, 24);
+	/* Spill over several chunks */
+	for(i = 0; i < 100; i++) {
+		if((ptr = my_region_alloc(region, 40)) == NULL) {
+			fprintf(stderr, "my_region_alloc failed after %d calls\n", i);
+			return;
+		}
+		if(((intptr_t)ptr) % 8 != 0)
+			fprintf(stderr, "region alignment error after %d calls\n", i);
+		memset(ptr, i, 40);
+	}
+	my_region_reset(region);
+	if(my_region_alloc(region, 24) != first)
+		fprintf(stderr, "region reset didn't rewind the first chunk\n");
+	/* Sizes that would wrap when rounded or padded must fail */
+	errno = 0;
+	if(my_region_alloc(region, SIZE_MAX) != NULL || errno != ENOMEM)
+		fprintf(stderr, "my_region_alloc accepted SIZE_MAX\n");
+	if(my_region_alloc(region, SIZE_MAX - 20) != NULL)
+		fprintf(stderr, "my_region_alloc accepted SIZE_MAX - 20\n");
+	if(my_region_create(SIZE_MAX) != NULL)
+		fprintf(stderr, "my_region_create accepted SIZE_MAX\n");
+	if(my_region_create(SIZE_MAX - 30) != NULL)
+		fprintf(stderr, "my_region_create accepted SIZE_MAX - 30\n");
+	my_region_destroy(region);
+	printf("region survived %d allocations\n", i);
+}
+/* end debug_region */
+
+/* begin debug_free */
+void debug_free(void)
+{
+	char *ptrs[1000];
+	char *ptr, *big, *low, *high;
+	void *brk_before;
+	int i;
+	/* Freed small blocks should come straight back, LIFO */
+	ptr = malloc(40);
+	free(ptr);
+	big = malloc(40);
+	if(big != ptr)
+		fprintf(stderr, "quick list didn't hand back the freed block\n");
+	free(big);
+	/* Enough churn to go past the quick list limit */
+	for(i = 0; i < 1000; i++)
+		ptrs[i] = malloc(16 + (i % 3) * 16);
+	low = ptrs[0];
+	high = ptrs[0];
+	for(i = 0; i < 1000; i++) {
+		if(ptrs[i] < low)
+			low = ptrs[i];
+		if(ptrs[i] > high)
+			high = ptrs[i];
+		free(ptrs[i]);
+	}
+	/* Going past the limit must have coalesced the small blocks, so a
+		block bigger than any of them is carved out of their space and
+		the heap doesn't grow */
+	brk_before = sbrk(0);
+	ptr = malloc(2000);
+	if(ptr > high || ptr + 2000 <= low)
+		fprintf(stderr, "quick lists weren't consolidated\n");
+	if(sbrk(0) != brk_before)
+		fprintf(stderr, "heap grew instead of reusing the quick lists\n");
+	free(ptr);
+	/* Large blocks are coalesced right away */
+	ptr = malloc(2000);
+	big = malloc(2000);
+	free(ptr);
+	free(big);
+	if(malloc(4000) != ptr)
+		fprintf(stderr, "freed neighbours weren't coalesced\n");
+	printf("free survived %d allocations\n", i);
+}
+/* end debug_free */
+
+/* begin debug_trace */
+/* WARNING: ONLY SYSCALLS HERE; LIBC'S OWN MALLOC MOVES THE BRK UNDER OUR
+	HEAP, SO NO setenv, popen OR fopen */
+void debug_trace(const char *self, const char *limit)
+{
+	/* Out of timestamp order, reuse an address and free one block that
+		was allocated before the trace started */
+	struct trace_event events[5] = {
+		{ 30, 0x1000, 50, 2, TRACE_MALLOC, 2, 0, 0 },
+		{ 40, 0x1000, 72, 2, TRACE_FREE, 2, 0, 0 },
+		{ 10, 0x1000, 100, 1, TRACE_MALLOC, 2, 1, 0 },
+		{ 20, 0x1000, 120, 1, TRACE_FREE, 2, 0, 0 },
+		{ 5, 0x2000, 40, 1, TRACE_FREE, 1, 0, 0 },
+	};
+	const char *expected = "100\n2\n4\n1\na 0 100\nf 0\na 1 50\nf 1\n";
+	char trace[64], replay[64], data[4096], exe[PATH_MAX], convert[PATH_MAX];
+	const char *convert_argv[] = { convert, trace, NULL };
+	const char *child_argv[] = { exe, limit, "trace", NULL };
+	const char *child_envp[] = { NULL, NULL };
+	struct trace_event event;
+	char env[96];
+	char *slash;
+	int length;
+	/* mm_trace_convert is built next to us, wherever we're run from */
+	length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if(length < 0)
+		snprintf(exe, sizeof(exe), "%s", self);
+	else
+		exe[length] = '\0';
+	slash = strrchr(exe, '/');
+	snprintf(convert, sizeof(convert), "%.*s/mm_trace_convert",
+			slash == NULL ? 1 : (int)(slash - exe),
+			slash == NULL ? "." : exe);
+	snprintf(trace, sizeof(trace), "/tmp/mm_trace_%d.bin", (int)getpid());
+	snprintf(replay, sizeof(replay), "/tmp/mm_trace_%d.rep", (int)getpid());
+	/* The converter on a hand-made trace */
+	if(write_trace(trace, events, 5) < 0 ||
+		run_process(convert_argv, child_envp, replay) != 0) {
+		fprintf(stderr, "couldn't convert the hand-made trace\n");
+		return;
+	}
+	length = read_file(replay, data, sizeof(data));
+	if(length < 0 || strcmp(data, expected) != 0)
+		fprintf(stderr, "hand-made trace converted to:\n%s", data);
+	/* Record debug_trace_child and convert what it recorded */
+	snprintf(env, sizeof(env), "%s=%s", TRACE_ENV_VAR, trace);
+	child_envp[0] = env;
+	if(run_process(child_argv, child_envp, "/dev/null") != 0) {
+		fprintf(stderr, "traced child failed\n");
+		return;
+	}
+	child_envp[0] = NULL;
+	length = read_file(trace, data, sizeof(data));
+	if(length != 8 + TRACE_CHILD_EVENTS * (int)sizeof(struct trace_event))
+		fprintf(stderr, "recorded %d bytes of trace\n", length);
+	if(run_process(convert_argv, child_envp, replay) != 0 ||
+		read_file(replay, data, sizeof(data)) < 0 ||
+		check_replay(data, 4, TRACE_CHILD_EVENTS) < 0)
+		fprintf(stderr, "recorded trace converted to:\n%s", data);
+	/* Both malloc paths record the size asked for, not the block size */
+	if(read_trace_event(trace, 0, &event) < 0 || event.size != 100)
+		fprintf(stderr, "malloc(size) recorded %lu bytes\n",
+				(unsigned long)event.size);
+	if(read_trace_event(trace, 6, &event) < 0 || event.size != 20)
+		fprintf(stderr, "malloc(sizeof(T)) recorded %lu bytes\n",
+				(unsigned long)event.size);
+	unlink(trace);
+	unlink(replay);
+	printf("trace survived %d events\n", TRACE_CHILD_EVENTS);
+}
+
+/* Records a known sequence when run with MM_TRACE set, then forks; the
+	fork's events must go to their own file and the ones we still buffer
+	must not be written twice. Returns 0 if the fork was traced right */
+int debug_trace_child(void)
+{
+	volatile size_t size = 100;/* Not a constant, goes through my_malloc */
+	struct twenty_bytes { char bytes[20]; } *constant;
+	char *first, *second;
+	char path[PATH_MAX], data[4096];
+	int status, length;
+	pid_t pid;
+	first = malloc(size);
+	second = malloc(40);
+	free(second);
+	/* Comes back from the quick list at the same address as second */
+	second = malloc(40);
+	free(second);
+	free(first);
+	/* A constant size, folded by mm.h into a my_malloc_class call */
+	constant = malloc(sizeof(*constant));
+	free(constant);
+	/* Exiting runs the at-exit flush in the fork too */
+	if((pid = fork()) == 0) {
+		free(malloc(size));
+		exit(0);
+	}
+	if(pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return 1;
+	snprintf(path, sizeof(path), "%s.%d", getenv(TRACE_ENV_VAR), (int)pid);
+	length = read_file(path, data, sizeof(data));
+	unlink(path);
+	if(length != 8 + 2 * (int)sizeof(struct trace_event)) {
+		fprintf(stderr, "the fork recorded %d bytes of trace\n", length);
+		return 1;
+	}
+	return 0;
+}
+
+static int write_trace(const char *path, struct trace_event *events,
+						int count)
+{
+	int length = count * sizeof(*events);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1;
+	if(write(fd, TRACE_MAGIC, 8) != 8 || write(fd, events, length) != length) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* Runs argv[0] with stdout sent to output, returns its exit status */
+static int run_process(const char *const argv[], const char *const envp[],
+						const char *output)
+{
+	int status, fd;
+	pid_t pid = fork();
+	if(pid < 0)
+		return -1;
+	if(pid == 0) {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+			_exit(127);
+		execve(argv[0], (char *const *)argv, (char *const *)envp);
+		_exit(127);
+	}
+	if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+/* Reads a whole file into data and 0-terminates it, returns its length */
+static int read_file(const char *path, char *data, int size)
+{
+	int length = 0, got;
+	int fd = open(path, O_RDONLY);
+	data[0] = '\0';
+	if(fd < 0)
+		return -1;
+	while(length < size - 1 &&
+			(got = read(fd, data + length, size - 1 - length)) > 0)
+		length += got;
+	data[length] = '\0';
+	close(fd);
+	return length;
+}
+
+/* Reads the index-th event of a recorded trace */
+static int read_trace_event(const char *path, int index,
+							struct trace_event *event)
+{
+	int got;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	got = pread(fd, event, sizeof(*event), 8 + index * sizeof(*event));
+	close(fd);
+	return got == (int)sizeof(*event) ? 0 : -1;
+}
+
+/* Checks the header counts and that every f frees a live a */
+static int check_replay(const char *replay, int ids, int ops)
+{
+	int header[4], live[64] = { 0 }, id, count = 0;
+	unsigned long bytes;
+	for(int i = 0; i < 4; i++) {
+		if(sscanf(replay, "%d", &header[i]) != 1)
+			return -1;
+		replay = strchr(replay, '\n') + 1;
+	}
+	if(header[1] != ids || header[2] != ops)
+		return -1;
+	for(; *replay != '\0'; replay = strchr(replay, '\n') + 1, count++) {
+		if(sscanf(replay, "a %d %lu", &id, &bytes) == 2) {
+			if(id < 0 || id >= 64 || live[id] != 0)
+				return -1;
+			live[id] = 1;
+		}
+		else if(sscanf(replay, "f %d", &id) == 1) {
+			if(id < 0 || id >= 64 || live[id] != 1)
+				return -1;
+			live[id] = 2;
+		}
+		else
+			return -1;
+	}
+	for(id = 0; id < ids; id++) {
+		if(live[id] != 2)
+			return -1;
+	}
+	return count == ops ? 0 : -1;
+}
+/* end debug_trace */
+
+/* begin debug_pick_list */
+/* The comparison chain pick_list used before MM_PICK_LIST */
+static int pick_list_by_chain(size_t size)
+{
+	int list_num = 0;
+	for(size_t limit = 32; list_num < 10 && size > limit; limit *= 2)
+		list_num++;
+	return list_num;
+}
+
+/* The Makefile links with --wrap=my_malloc_class so every call the test
+	code makes to it lands here first */
+void *__real_my_malloc_class(size_t size, size_t block_size, int list_num);
+void *__wrap_my_malloc_class(size_t size, size_t block_size, int list_num)
+{
+	class_calls++;
+	return __real_my_malloc_class(size, block_size, list_num);
+}
+
+void debug_pick_list(void)
+{
+	struct twenty_bytes { char bytes[20]; } *constant;
+	volatile size_t variable = 20;
+	char *ptr;
+	size_t size;
+	int calls;
+	for(size = 24; size <= 1024 * 1024; size += 8) {
+		if(MM_PICK_LIST(size) != pick_list_by_chain(size))
+			fprintf(stderr, "MM_PICK_LIST(%zu) = %d, the chain says %d\n",
+					size, MM_PICK_LIST(size), pick_list_by_chain(size));
+	}
+	/* Constant sizes must be folded into a my_malloc_class call, the
+		others must go through my_malloc */
+	calls = class_calls;
+	constant = malloc(sizeof(*constant));
+	if(class_calls != calls + 1)
+		fprintf(stderr, "malloc(sizeof(T)) skipped my_malloc_class\n");
+	free(constant);
+	calls = class_calls;
+	ptr = malloc(variable);
+	if(class_calls != calls)
+		fprintf(stderr, "malloc(variable) went through my_malloc_class\n");
+	free(ptr);
+	printf("pick_list agreed up to %zu bytes\n", size - 8);
+}
+/* end debug_pick_list */
@@ -32,4 +32,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define MALLOC_V1_TEST_FUNCTIONS_H
 
 void debug_alignment(void);
+void debug_region(void);
+void debug_free(void);
+void debug_trace(const char *self, const char *limit);
+int debug_trace_child(void);
+void debug_pick_list(void);
 #endif 
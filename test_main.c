@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include "mm.h"
@@ -44,6 +45,10 @@ int main(int argc, char *argv[])
     lim.rlim_cur = atoi(argv[1]);
     lim.rlim_max = atoi(argv[1]);
     assert(setrlimit(RLIMIT_DATA, &lim) == 0);
+    /* debug_trace re-runs us with MM_TRACE set to record a known sequence */
+    if(argc > 2 && strcmp(argv[2], "trace") == 0) {
+        return debug_trace_child();
+    }
     
     assert(malloc(1024 * 1024) != NULL);
     
@@ -57,6 +62,10 @@ int main(int argc, char *argv[])
 		printf("First malloc returned NULL");
 		return 1;
 	}
+	debug_region();
+	debug_free();
+	debug_trace(argv[0], argv[1]);
+	debug_pick_list();
 	/*
     for(int i = 0; i < 10; i++)
 		ptr[i] = i * 10;